@@ -3,8 +3,33 @@
 #include <SDL_ttf.h>
 #include <cmath>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <queue>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstddef>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <deque>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 //TODO create new renderer for each window
 const int MAP_WIDTH = 5000;
 const int MAP_HEIGHT = 5000;
@@ -69,6 +94,284 @@ private:
 	int mHeight;
 };
 
+//Point on the field in map pixels
+struct FieldPoint {
+	double x, y;
+};
+
+class Guidance {
+public:
+	//Occupancy grid cell, one dot footprint per cell
+	static const int GRID_CELL = Dot::DOT_WIDTH;
+	static const int GRID_COLS = MAP_WIDTH / GRID_CELL;
+	static const int GRID_ROWS = MAP_HEIGHT / GRID_CELL;
+	//Implement width, distance between neighbouring swaths
+	static const int SWATH_WIDTH = 100;
+	//Init the variables
+	Guidance();
+	//Sets the A-B line and plans all swaths and headland turns
+	void setABLine(FieldPoint a, FieldPoint b);
+	//Marks the rect as blocked, resplits the swaths and replans only the links it cuts through
+	void addObstacle(SDL_Rect obstacle);
+	//Recomputes cross-track error for the vehicle centre
+	void update(double x, double y);
+	//Signed distance to the nearest swath, positive right of travel
+	double getCrossTrackError();
+	//Index of the nearest swath
+	int getActiveSwath();
+	//Shows swaths and turns relative to camera
+	void render(int camX, int camY);
+	//Plans around obstacles added after the A-B line and checks the result, --check-guidance
+	static bool selfTest();
+private:
+	struct Swath {
+		//Whole line across the field, in travel direction
+		FieldPoint start, end;
+		//Start and end of each run of free ground, in travel direction
+		std::vector<FieldPoint> free;
+	};
+	//Lays parallel lines over the field, alternating direction
+	void planSwaths();
+	//Splits a swath into runs of free ground
+	void splitSwath(Swath& swath);
+	//Links every run of free ground to the next one in driving order
+	void planLinks();
+	//True if every cell is free and no diagonal step cuts a blocked corner
+	bool pathClear(const std::vector<int>& path);
+	//True if every link has a drivable path between its ends
+	bool linksValid();
+	//A* over the occupancy grid, path holds cell indices start to goal
+	bool findPath(int startCell, int goalCell, std::vector<int>& path);
+	//Grid cell holding a map point, clamped to the field
+	int cellAt(FieldPoint p);
+	//Occupancy grid, non zero cells are blocked
+	std::vector<Uint8> mBlocked;
+	std::vector<Swath> mSwaths;
+	//Path from the end of one run of free ground to the start of the next, around
+	//an obstacle within a swath or as a headland turn to the next swath
+	struct Link {
+		int fromCell, toCell;
+		//Grid cells from start to goal, empty if there is no way through
+		std::vector<int> path;
+	};
+	std::vector<Link> mLinks;
+	//A* scratch, reused between searches. mVisit stamps avoid clearing
+	std::vector<float> mCost;
+	std::vector<int> mParent;
+	std::vector<Uint32> mVisit;
+	Uint32 mSearchId;
+	//A-B line origin, unit direction and right hand normal
+	FieldPoint mA, mDir, mNormal;
+	//Offset index of swath 0 along the normal
+	int mFirstSwath;
+	double mCrossTrack;
+	int mActiveSwath;
+};
+
+//Vehicle and field state that survives a restart
+struct SessionState {
+	//Dot position in map pixels
+	Sint32 posX, posY;
+	//Map rotation
+	double degrees;
+	//Wall clock ms when the session timer was started, 0 if never
+	Sint64 sessionStart;
+	//A-B line, valid when hasABLine is set
+	Uint8 hasABLine;
+	FieldPoint abA, abB;
+};
+
+class Journal {
+public:
+	//Writer thread gathers records this long before one write and fsync, in ms
+	static const Uint32 FLUSH_INTERVAL = 100;
+	//A compact snapshot is taken this often and the journal starts over
+	static const Uint32 SNAPSHOT_INTERVAL = 10000;
+	//Unwritten bytes kept for retry after a failed write or fsync
+	static const size_t MAX_RETRY = 1 << 20;
+	//Init the variables
+	Journal();
+	//Flushes and stops the writer
+	~Journal();
+	//Recovers the last session into state and starts appending to path
+	bool open(std::string path, SessionState& state, bool& recovered);
+	//Queues vehicle state, skipped when nothing changed
+	void logState(Sint32 posX, Sint32 posY, double degrees);
+	//Queues a new session timer start, in wall clock ms
+	void logSessionStart(Sint64 start);
+	//Queues a new A-B line
+	void logABLine(FieldPoint a, FieldPoint b);
+	//Wall clock ms since the epoch, the session start is kept in these
+	static Sint64 wallClock();
+	//Writes the last batch and a final snapshot, stops the writer thread
+	void close();
+private:
+	enum RecordType {
+		RECORD_STATE = 1,
+		RECORD_AB_LINE,
+		RECORD_SESSION_START
+	};
+	//In front of every record, crc covers type, length and payload
+	struct RecordHeader {
+		Uint16 type;
+		Uint16 length;
+		Uint32 crc;
+	};
+	struct StateRecord {
+		double degrees;
+		Sint32 posX, posY;
+	};
+	struct ABLineRecord {
+		FieldPoint a, b;
+	};
+	struct SessionStartRecord {
+		Sint64 start;
+	};
+	//Snapshot file contents, crc covers the state
+	struct Snapshot {
+		Uint32 magic;
+		Uint32 crc;
+		SessionState state;
+	};
+	//Encodes a record into the pending batch
+	void append(Uint16 type, const void* payload, Uint16 length);
+	//Applies one record to state, false if it is malformed
+	static bool apply(SessionState& state, Uint16 type, const Uint8* payload, Uint16 length);
+	//Applies every intact record in buffer, returns bytes consumed
+	static size_t replay(SessionState& state, const Uint8* buffer, size_t size);
+	static Uint32 crc32(const void* data, size_t length, Uint32 crc);
+	//Replaces the snapshot file atomically
+	bool writeSnapshot();
+	//Background thread body
+	void writerLoop();
+	std::string mPath;
+	std::string mSnapshotPath;
+	int mFd;
+	//Main thread side, last state queued
+	SessionState mLast;
+	bool mHasLast;
+	//Shared between threads
+	std::mutex mMutex;
+	std::condition_variable mWake;
+	std::vector<Uint8> mPending;
+	bool mStop;
+	std::thread mWriter;
+	//Writer thread side, state and size of what is on disk
+	SessionState mDurable;
+	Uint64 mDurableOffset;
+};
+
+//Live status streamed to monitoring subscribers
+struct TelemetrySample {
+	//Dot position in map pixels
+	Sint32 posX, posY;
+	//Direction of travel in tenths of a degree, 0 is up
+	Sint16 heading;
+	//Frames presented per second and slowest frame in ms since the last sample
+	Uint16 fps;
+	Uint16 worstFrame;
+	//Session timer in ms
+	Uint32 elapsed;
+};
+
+class Telemetry {
+public:
+	static const int MAX_SUBSCRIBERS = 16;
+	//Samples waiting for the I/O thread, oldest dropped when full
+	static const size_t SAMPLE_QUEUE = 64;
+	//Unsent bytes per subscriber before its messages are dropped
+	static const size_t SUBSCRIBER_BUFFER = 4096;
+	//Kernel send buffer per subscriber, keeps a slow one from piling up stale samples
+	static const int SOCKET_BUFFER = 4096;
+	//Accepted publish rates
+	static const int MIN_RATE = 1;
+	static const int MAX_RATE = 100;
+	//Init the variables
+	Telemetry();
+	//Stops the I/O thread
+	~Telemetry();
+	//Listens on host:port or a Unix socket path and starts the I/O thread
+	bool start(std::string address, int rateHz);
+	//Counts a presented frame for the frame stats
+	void frameRendered();
+	//Queues a sample when the rate allows, never waits on subscribers
+	void publish(Sint32 posX, Sint32 posY, double heading, Uint32 elapsed);
+	//Ms until publish takes the next sample, (Uint32)-1 while nobody listens
+	Uint32 untilNextSample();
+	//Closes every socket and joins the I/O thread
+	void stop();
+private:
+	struct Subscriber {
+		int fd;
+		//Encoded messages not yet accepted by the socket
+		std::vector<Uint8> out;
+		size_t sent;
+		//Set for new subscribers and after a drop, deltas need a base
+		bool needKeyframe;
+		bool waitingWrite;
+	};
+	//Binds and listens, fills mListenFd
+	bool listenOn(std::string address);
+	//Background thread body
+	void ioLoop();
+	void acceptSubscribers();
+	//Queues one sample on a subscriber, dropping it when the buffer is full
+	void send(Subscriber& subscriber, const std::vector<Uint8>& keyframe, const std::vector<Uint8>& delta);
+	//Writes what the socket takes, false if the subscriber went away
+	bool flush(Subscriber& subscriber);
+	void dropSubscriber(int index);
+	//Full sample, first byte has the high bit set
+	static void encodeKeyframe(const TelemetrySample& sample, std::vector<Uint8>& out);
+	//Field mask then a zigzag varint per changed field
+	static void encodeDelta(const TelemetrySample& previous, const TelemetrySample& sample, std::vector<Uint8>& out);
+	int mListenFd;
+	int mEpollFd;
+	int mWakeFd;
+	std::string mUnixPath;
+	//Main thread side, rate limit and frame stats
+	Uint32 mPeriod;
+	Uint32 mLastPublish;
+	Uint32 mLastFrame;
+	Uint32 mFrames;
+	Uint32 mWorstFrame;
+	//Shared between threads
+	std::mutex mMutex;
+	std::deque<TelemetrySample> mQueue;
+	bool mStop;
+	std::thread mIo;
+	//I/O thread side
+	std::vector<Subscriber> mSubscribers;
+	TelemetrySample mPrevious;
+	bool mHasPrevious;
+	//Read by the main thread to skip sampling when nobody listens
+	std::atomic<int> mSubscriberCount;
+};
+
+class IdleScheduler {
+public:
+	//How often utilisation is printed, in ms
+	static const Uint32 REPORT_INTERVAL = 60000;
+	//Init the variables
+	IdleScheduler();
+	//Sleeps while idle until an event arrives or timeout ms pass, true if there is something to draw
+	bool wait(bool active, Uint32 timeout);
+	//Counts a presented frame
+	void frameRendered();
+	//Prints CPU use and presented frames per second for idle and active time
+	void report();
+private:
+	//Adds time since the last call to the current mode
+	void account();
+	bool mActive;
+	Uint32 mLastTick;
+	clock_t mLastCpu;
+	Uint32 mLastReport;
+	//Indexed by mode, 0 idle and 1 active
+	Uint32 mWall[2];
+	double mCpu[2];
+	Uint32 mFrames[2];
+};
+
 enum KeyPressSurfaces {
 	KEY_PRESS_SURFACE_DEFAULT,
 	KEY_PRESS_SURFACE_UP,
@@ -121,6 +424,8 @@ LTexture gDotTexture;
 LTexture gBGTexture;
 LTexture gTimeTextTexture;
 LTexture gPromptTextTexture;
+//Pushed by background threads to wake the idle loop
+Uint32 gWakeEvent = (Uint32)-1;
 ///////////////////////////////////////////////END OF GV//////////////////////////////////////////////////////////
 LTexture::LTexture() {
 	//Initialize
@@ -333,6 +638,1192 @@ int Dot::getPosY() {
 	return mPosY;
 }
 
+Guidance::Guidance() {
+	//Empty field, no A-B line yet
+	mBlocked.assign(GRID_COLS * GRID_ROWS, 0);
+	mCost.assign(GRID_COLS * GRID_ROWS, 0.0f);
+	mParent.assign(GRID_COLS * GRID_ROWS, -1);
+	mVisit.assign(GRID_COLS * GRID_ROWS, 0);
+	mSearchId = 0;
+	mA.x = 0; mA.y = 0;
+	mDir.x = 0; mDir.y = -1;
+	mNormal.x = 1; mNormal.y = 0;
+	mFirstSwath = 0;
+	mCrossTrack = 0;
+	mActiveSwath = -1;
+}
+
+void Guidance::setABLine(FieldPoint a, FieldPoint b) {
+	double dx = b.x - a.x;
+	double dy = b.y - a.y;
+	double length = sqrt(dx * dx + dy * dy);
+	if (length < 1.0) {
+		printf("A-B line too short, points must differ!\n");
+		return;
+	}
+	mA = a;
+	mDir.x = dx / length;
+	mDir.y = dy / length;
+	//Right hand side of travel, y axis points down
+	mNormal.x = -mDir.y;
+	mNormal.y = mDir.x;
+	planSwaths();
+	planLinks();
+}
+
+void Guidance::addObstacle(SDL_Rect obstacle) {
+	//Mark every cell the rect touches, clamped to the field
+	int left = obstacle.x / GRID_CELL;
+	int right = (obstacle.x + obstacle.w - 1) / GRID_CELL;
+	int top = obstacle.y / GRID_CELL;
+	int bottom = (obstacle.y + obstacle.h - 1) / GRID_CELL;
+	if (left < 0) left = 0;
+	if (top < 0) top = 0;
+	if (right >= GRID_COLS) right = GRID_COLS - 1;
+	if (bottom >= GRID_ROWS) bottom = GRID_ROWS - 1;
+	for (int row = top; row <= bottom; ++row) {
+		for (int col = left; col <= right; ++col) {
+			mBlocked[row * GRID_COLS + col] = 1;
+		}
+	}
+	for (int i = 0; i < (int)mSwaths.size(); ++i) {
+		splitSwath(mSwaths[i]);
+	}
+	planLinks();
+}
+
+void Guidance::update(double x, double y) {
+	if (mSwaths.empty()) {
+		mCrossTrack = 0;
+		mActiveSwath = -1;
+		return;
+	}
+	//Offset across the swaths from the A-B line
+	double offset = (x - mA.x) * mNormal.x + (y - mA.y) * mNormal.y;
+	//Nearest swath inside the field, the error is measured to that one
+	int k = (int)floor(offset / SWATH_WIDTH + 0.5);
+	if (k < mFirstSwath) {
+		k = mFirstSwath;
+	}
+	if (k >= mFirstSwath + (int)mSwaths.size()) {
+		k = mFirstSwath + (int)mSwaths.size() - 1;
+	}
+	mActiveSwath = k - mFirstSwath;
+	mCrossTrack = offset - (double)k * SWATH_WIDTH;
+	//Every other swath is driven backwards, so its right hand side flips
+	if (mActiveSwath % 2 == 1) {
+		mCrossTrack = -mCrossTrack;
+	}
+}
+
+double Guidance::getCrossTrackError() {
+	return mCrossTrack;
+}
+
+int Guidance::getActiveSwath() {
+	return mActiveSwath;
+}
+
+void Guidance::render(int camX, int camY) {
+	//Free ground of each swath in green
+	SDL_SetRenderDrawColor(gRendererMain, 0x00, 0xC0, 0x00, 0xFF);
+	for (int i = 0; i < (int)mSwaths.size(); ++i) {
+		const std::vector<FieldPoint>& free = mSwaths[i].free;
+		for (int j = 0; j + 1 < (int)free.size(); j += 2) {
+			SDL_RenderDrawLine(gRendererMain, (int)free[j].x - camX, (int)free[j].y - camY,
+				(int)free[j + 1].x - camX, (int)free[j + 1].y - camY);
+		}
+	}
+	//Headland turns and detours in yellow, through the cell centres
+	SDL_SetRenderDrawColor(gRendererMain, 0xFF, 0xFF, 0x00, 0xFF);
+	for (int i = 0; i < (int)mLinks.size(); ++i) {
+		const std::vector<int>& path = mLinks[i].path;
+		for (int j = 1; j < (int)path.size(); ++j) {
+			int from = path[j - 1];
+			int to = path[j];
+			SDL_RenderDrawLine(gRendererMain,
+				(from % GRID_COLS) * GRID_CELL + GRID_CELL / 2 - camX, (from / GRID_COLS) * GRID_CELL + GRID_CELL / 2 - camY,
+				(to % GRID_COLS) * GRID_CELL + GRID_CELL / 2 - camX, (to / GRID_COLS) * GRID_CELL + GRID_CELL / 2 - camY);
+		}
+	}
+	SDL_SetRenderDrawColor(gRendererMain, 0xFF, 0xFF, 0xFF, 0xFF);
+}
+
+//Narrows [t0, t1] so that p + t*d stays within [0, max] on one axis
+static bool clipAxis(double p, double d, double max, double& t0, double& t1) {
+	if (fabs(d) < 1e-9) {
+		return p >= 0 && p <= max;
+	}
+	double ta = (0 - p) / d;
+	double tb = (max - p) / d;
+	if (ta > tb) {
+		double swap = ta;
+		ta = tb;
+		tb = swap;
+	}
+	if (ta > t0) t0 = ta;
+	if (tb < t1) t1 = tb;
+	return t0 <= t1;
+}
+
+void Guidance::planSwaths() {
+	mSwaths.clear();
+	double maxX = MAP_WIDTH - 1;
+	double maxY = MAP_HEIGHT - 1;
+	//Range of offsets the field corners span across the A-B line
+	FieldPoint corners[4] = { { 0, 0 }, { maxX, 0 }, { 0, maxY }, { maxX, maxY } };
+	double minOffset = 0, maxOffset = 0;
+	for (int i = 0; i < 4; ++i) {
+		double offset = (corners[i].x - mA.x) * mNormal.x + (corners[i].y - mA.y) * mNormal.y;
+		if (i == 0 || offset < minOffset) minOffset = offset;
+		if (i == 0 || offset > maxOffset) maxOffset = offset;
+	}
+	int kMin = (int)ceil(minOffset / SWATH_WIDTH);
+	int kMax = (int)floor(maxOffset / SWATH_WIDTH);
+	mFirstSwath = kMin;
+	for (int k = kMin; k <= kMax; ++k) {
+		FieldPoint p;
+		p.x = mA.x + mNormal.x * k * SWATH_WIDTH;
+		p.y = mA.y + mNormal.y * k * SWATH_WIDTH;
+		double t0 = -1e18, t1 = 1e18;
+		if (!clipAxis(p.x, mDir.x, maxX, t0, t1) || !clipAxis(p.y, mDir.y, maxY, t0, t1)) {
+			//Line only touches a corner, start counting from the next one
+			if (mSwaths.empty()) {
+				mFirstSwath = k + 1;
+			}
+			continue;
+		}
+		Swath swath;
+		swath.start.x = p.x + mDir.x * t0;
+		swath.start.y = p.y + mDir.y * t0;
+		swath.end.x = p.x + mDir.x * t1;
+		swath.end.y = p.y + mDir.y * t1;
+		//Back and forth pattern
+		if (mSwaths.size() % 2 == 1) {
+			FieldPoint swap = swath.start;
+			swath.start = swath.end;
+			swath.end = swap;
+		}
+		splitSwath(swath);
+		mSwaths.push_back(swath);
+	}
+}
+
+void Guidance::splitSwath(Swath& swath) {
+	swath.free.clear();
+	double dx = swath.end.x - swath.start.x;
+	double dy = swath.end.y - swath.start.y;
+	double length = sqrt(dx * dx + dy * dy);
+	//Half cell steps so no cell on the way is skipped
+	int steps = (int)(length / (GRID_CELL / 2.0));
+	bool inRun = false;
+	FieldPoint last = swath.start;
+	for (int i = 0; i <= steps; ++i) {
+		double t = steps > 0 ? (double)i / steps : 0;
+		FieldPoint p = { swath.start.x + dx * t, swath.start.y + dy * t };
+		bool blocked = mBlocked[cellAt(p)] != 0;
+		if (!blocked && !inRun) {
+			swath.free.push_back(p);
+		}
+		else if (blocked && inRun) {
+			swath.free.push_back(last);
+		}
+		inRun = !blocked;
+		last = p;
+	}
+	if (inRun) {
+		swath.free.push_back(last);
+	}
+}
+
+void Guidance::planLinks() {
+	std::vector<Link> previous;
+	previous.swap(mLinks);
+	int lastCell = -1;
+	int lastSwath = -1;
+	//Swaths wholly inside an obstacle have no runs and drop out of the chain
+	for (int i = 0; i < (int)mSwaths.size(); ++i) {
+		const std::vector<FieldPoint>& free = mSwaths[i].free;
+		for (int j = 0; j + 1 < (int)free.size(); j += 2) {
+			int startCell = cellAt(free[j]);
+			if (lastCell >= 0) {
+				Link link;
+				link.fromCell = lastCell;
+				link.toCell = startCell;
+				//Obstacles are only ever added, so a path that is still clear stays
+				//the shortest and one that failed still has no way through
+				bool reused = false;
+				for (int k = 0; k < (int)previous.size(); ++k) {
+					if (previous[k].fromCell == link.fromCell && previous[k].toCell == link.toCell) {
+						if (previous[k].path.empty() || pathClear(previous[k].path)) {
+							link.path.swap(previous[k].path);
+							reused = true;
+						}
+						break;
+					}
+				}
+				if (!reused && !findPath(link.fromCell, link.toCell, link.path)) {
+					printf("No path found from swath %d to swath %d!\n", lastSwath, i);
+				}
+				mLinks.push_back(link);
+			}
+			lastCell = cellAt(free[j + 1]);
+			lastSwath = i;
+		}
+	}
+}
+
+bool Guidance::pathClear(const std::vector<int>& path) {
+	for (int i = 0; i < (int)path.size(); ++i) {
+		if (mBlocked[path[i]]) {
+			return false;
+		}
+		if (i == 0) {
+			continue;
+		}
+		//Same corner rule as findPath
+		int col = path[i - 1] % GRID_COLS;
+		int row = path[i - 1] / GRID_COLS;
+		int nextCol = path[i] % GRID_COLS;
+		int nextRow = path[i] / GRID_COLS;
+		if (col != nextCol && row != nextRow &&
+			(mBlocked[row * GRID_COLS + nextCol] || mBlocked[nextRow * GRID_COLS + col])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Guidance::linksValid() {
+	for (int i = 0; i < (int)mLinks.size(); ++i) {
+		const std::vector<int>& path = mLinks[i].path;
+		if (path.empty() || path.front() != mLinks[i].fromCell || path.back() != mLinks[i].toCell || !pathClear(path)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Guidance::selfTest() {
+	bool success = true;
+	Guidance guidance;
+	SDL_Rect wall = { 527, 5, 389, 560 };
+	guidance.addObstacle(wall);
+	FieldPoint a = { 285, 470 };
+	FieldPoint b = { 285, 0 };
+	guidance.setABLine(a, b);
+	//Block the corner beside a diagonal step, the step must not survive replanning
+	int corner = -1, stepFrom = -1, stepTo = -1;
+	for (int i = 0; i < (int)guidance.mLinks.size() && corner < 0; ++i) {
+		const std::vector<int>& path = guidance.mLinks[i].path;
+		for (int j = 1; j < (int)path.size() && corner < 0; ++j) {
+			int col = path[j - 1] % GRID_COLS;
+			int nextRow = path[j] / GRID_COLS;
+			if (col != path[j] % GRID_COLS && path[j - 1] / GRID_COLS != nextRow) {
+				corner = nextRow * GRID_COLS + col;
+				stepFrom = path[j - 1];
+				stepTo = path[j];
+			}
+		}
+	}
+	if (corner < 0) {
+		printf("Guidance check found no diagonal step to block!\n");
+		success = false;
+	}
+	else {
+		SDL_Rect rock = { (corner % GRID_COLS) * GRID_CELL, (corner / GRID_COLS) * GRID_CELL, GRID_CELL, GRID_CELL };
+		guidance.addObstacle(rock);
+		for (int i = 0; i < (int)guidance.mLinks.size(); ++i) {
+			const std::vector<int>& path = guidance.mLinks[i].path;
+			for (int j = 1; j < (int)path.size(); ++j) {
+				if ((path[j - 1] == stepFrom && path[j] == stepTo) || (path[j - 1] == stepTo && path[j] == stepFrom)) {
+					printf("Guidance check still cuts the corner at cell %d!\n", corner);
+					success = false;
+				}
+			}
+		}
+	}
+	//An obstacle mid-field splits swaths, their runs must be linked around it
+	SDL_Rect pond = { 2000, 2000, 300, 300 };
+	guidance.addObstacle(pond);
+	int runs = 0;
+	for (int i = 0; i < (int)guidance.mSwaths.size(); ++i) {
+		runs += (int)guidance.mSwaths[i].free.size() / 2;
+	}
+	if (!guidance.linksValid() || (int)guidance.mLinks.size() != runs - 1) {
+		printf("Guidance check found a link that is missing or not drivable!\n");
+		success = false;
+	}
+	//Near the field edge the error is to swath 0 at x=85, not a line outside the field
+	guidance.update(20, 2500);
+	if (guidance.getActiveSwath() != 0 || fabs(guidance.getCrossTrackError() + 65) > 1e-6) {
+		printf("Guidance check got cross-track error %.2f on swath %d, expected -65 on swath 0!\n",
+			guidance.getCrossTrackError(), guidance.getActiveSwath());
+		success = false;
+	}
+	return success;
+}
+
+int Guidance::cellAt(FieldPoint p) {
+	int col = (int)(p.x / GRID_CELL);
+	int row = (int)(p.y / GRID_CELL);
+	if (col < 0) col = 0;
+	if (row < 0) row = 0;
+	if (col >= GRID_COLS) col = GRID_COLS - 1;
+	if (row >= GRID_ROWS) row = GRID_ROWS - 1;
+	return row * GRID_COLS + col;
+}
+
+//Octile distance between two cells, admissible for 8-connected moves
+static float octile(int a, int b, int cols) {
+	int dx = abs(a % cols - b % cols);
+	int dy = abs(a / cols - b / cols);
+	int diagonal = dx < dy ? dx : dy;
+	return (float)(dx + dy) + (1.41421356f - 2.0f) * diagonal;
+}
+
+bool Guidance::findPath(int startCell, int goalCell, std::vector<int>& path) {
+	path.clear();
+	if (mBlocked[startCell] || mBlocked[goalCell]) {
+		return false;
+	}
+	//New stamp marks every cell unvisited without touching the arrays
+	if (++mSearchId == 0) {
+		mVisit.assign(mVisit.size(), 0);
+		mSearchId = 1;
+	}
+	typedef std::pair<float, int> Node;
+	std::priority_queue<Node, std::vector<Node>, std::greater<Node> > open;
+	mVisit[startCell] = mSearchId;
+	mCost[startCell] = 0;
+	mParent[startCell] = -1;
+	open.push(Node(octile(startCell, goalCell, GRID_COLS), startCell));
+	static const int stepX[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+	static const int stepY[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+	while (!open.empty()) {
+		Node top = open.top();
+		open.pop();
+		int cell = top.second;
+		//Stale entry, a cheaper one was already expanded
+		if (top.first > mCost[cell] + octile(cell, goalCell, GRID_COLS) + 1e-3f) {
+			continue;
+		}
+		if (cell == goalCell) {
+			for (int c = goalCell; c != -1; c = mParent[c]) {
+				path.push_back(c);
+			}
+			std::reverse(path.begin(), path.end());
+			return true;
+		}
+		int col = cell % GRID_COLS;
+		int row = cell / GRID_COLS;
+		for (int n = 0; n < 8; ++n) {
+			int nextCol = col + stepX[n];
+			int nextRow = row + stepY[n];
+			if (nextCol < 0 || nextRow < 0 || nextCol >= GRID_COLS || nextRow >= GRID_ROWS) {
+				continue;
+			}
+			int next = nextRow * GRID_COLS + nextCol;
+			if (mBlocked[next]) {
+				continue;
+			}
+			//No cutting corners past an obstacle
+			if (n >= 4 && (mBlocked[row * GRID_COLS + nextCol] || mBlocked[nextRow * GRID_COLS + col])) {
+				continue;
+			}
+			float cost = mCost[cell] + (n >= 4 ? 1.41421356f : 1.0f);
+			if (mVisit[next] != mSearchId || cost < mCost[next]) {
+				mVisit[next] = mSearchId;
+				mCost[next] = cost;
+				mParent[next] = cell;
+				open.push(Node(cost + octile(next, goalCell, GRID_COLS), next));
+			}
+		}
+	}
+	return false;
+}
+
+
+Journal::Journal() {
+	mFd = -1;
+	memset(&mLast, 0, sizeof(mLast));
+	mHasLast = false;
+	mStop = false;
+	memset(&mDurable, 0, sizeof(mDurable));
+	mDurableOffset = 0;
+}
+
+Journal::~Journal() {
+	close();
+}
+
+bool Journal::open(std::string path, SessionState& state, bool& recovered) {
+	recovered = false;
+	mPath = path;
+	mSnapshotPath = path + ".snap";
+	mFd = ::open(mPath.c_str(), O_RDWR | O_CREAT, 0644);
+	if (mFd < 0) {
+		printf("Unable to open journal %s! Error: %s\n", mPath.c_str(), strerror(errno));
+		return false;
+	}
+	//Another instance in this directory owns the journal
+	if (flock(mFd, LOCK_EX | LOCK_NB) != 0) {
+		printf("Journal %s is locked by another instance! Error: %s\n", mPath.c_str(), strerror(errno));
+		::close(mFd);
+		mFd = -1;
+		return false;
+	}
+	//Start from the last snapshot if there is an intact one
+	Snapshot snapshot;
+	int snapFd = ::open(mSnapshotPath.c_str(), O_RDONLY);
+	if (snapFd >= 0) {
+		if (read(snapFd, &snapshot, sizeof(snapshot)) == (ssize_t)sizeof(snapshot) && snapshot.magic == 0x50414E53 &&
+			snapshot.crc == crc32(&snapshot.state, sizeof(snapshot.state), 0)) {
+			state = snapshot.state;
+			recovered = true;
+		}
+		::close(snapFd);
+	}
+	//Replay the journal. It only holds records since the last snapshot, or records
+	//the snapshot already has if a crash came before the reset. Records overwrite
+	//fields, so replaying those again gives the same state
+	struct stat info;
+	fstat(mFd, &info);
+	std::vector<Uint8> journal((size_t)info.st_size);
+	size_t got = 0;
+	while (got < journal.size()) {
+		ssize_t n = pread(mFd, &journal[got], journal.size() - got, (off_t)got);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		got += (size_t)n;
+	}
+	if (got < journal.size()) {
+		printf("Unable to read journal %s! Error: %s\n", mPath.c_str(), strerror(errno));
+		::close(mFd);
+		mFd = -1;
+		return false;
+	}
+	//A torn record from a crash ends it
+	size_t used = journal.empty() ? 0 : replay(state, &journal[0], journal.size());
+	if (used > 0) {
+		recovered = true;
+	}
+	if (used < journal.size()) {
+		printf("Journal %s has a torn tail, dropping %d bytes\n", mPath.c_str(), (int)(journal.size() - used));
+		if (ftruncate(mFd, (off_t)used) != 0 || fsync(mFd) != 0) {
+			printf("Unable to truncate journal! Error: %s\n", strerror(errno));
+		}
+	}
+	lseek(mFd, (off_t)used, SEEK_SET);
+	mDurable = state;
+	mDurableOffset = used;
+	mLast = state;
+	mHasLast = recovered;
+	mStop = false;
+	mWriter = std::thread(&Journal::writerLoop, this);
+	return true;
+}
+
+void Journal::logState(Sint32 posX, Sint32 posY, double degrees) {
+	if (mFd < 0) {
+		return;
+	}
+	//A parked dot writes nothing, the timer is restored from the session start
+	if (mHasLast && posX == mLast.posX && posY == mLast.posY && degrees == mLast.degrees) {
+		return;
+	}
+	mLast.posX = posX;
+	mLast.posY = posY;
+	mLast.degrees = degrees;
+	mHasLast = true;
+	StateRecord record;
+	record.degrees = degrees;
+	record.posX = posX;
+	record.posY = posY;
+	append(RECORD_STATE, &record, sizeof(record));
+}
+
+void Journal::logSessionStart(Sint64 start) {
+	if (mFd < 0) {
+		return;
+	}
+	SessionStartRecord record;
+	record.start = start;
+	append(RECORD_SESSION_START, &record, sizeof(record));
+}
+
+void Journal::logABLine(FieldPoint a, FieldPoint b) {
+	if (mFd < 0) {
+		return;
+	}
+	ABLineRecord record;
+	record.a = a;
+	record.b = b;
+	append(RECORD_AB_LINE, &record, sizeof(record));
+}
+
+void Journal::close() {
+	if (mWriter.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStop = true;
+		}
+		mWake.notify_one();
+		mWriter.join();
+	}
+	if (mFd >= 0) {
+		::close(mFd);
+		mFd = -1;
+	}
+}
+
+void Journal::append(Uint16 type, const void* payload, Uint16 length) {
+	RecordHeader header;
+	header.type = type;
+	header.length = length;
+	header.crc = crc32(payload, length, crc32(&header, offsetof(RecordHeader, crc), 0));
+	bool wake;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		wake = mPending.empty();
+		const Uint8* bytes = (const Uint8*)&header;
+		mPending.insert(mPending.end(), bytes, bytes + sizeof(header));
+		bytes = (const Uint8*)payload;
+		mPending.insert(mPending.end(), bytes, bytes + length);
+	}
+	//Only the first record of a batch wakes the writer
+	if (wake) {
+		mWake.notify_one();
+	}
+}
+
+bool Journal::apply(SessionState& state, Uint16 type, const Uint8* payload, Uint16 length) {
+	if (type == RECORD_STATE && length == sizeof(StateRecord)) {
+		StateRecord record;
+		memcpy(&record, payload, sizeof(record));
+		state.posX = record.posX;
+		state.posY = record.posY;
+		state.degrees = record.degrees;
+		return true;
+	}
+	if (type == RECORD_SESSION_START && length == sizeof(SessionStartRecord)) {
+		SessionStartRecord record;
+		memcpy(&record, payload, sizeof(record));
+		state.sessionStart = record.start;
+		return true;
+	}
+	if (type == RECORD_AB_LINE && length == sizeof(ABLineRecord)) {
+		ABLineRecord record;
+		memcpy(&record, payload, sizeof(record));
+		state.hasABLine = 1;
+		state.abA = record.a;
+		state.abB = record.b;
+		return true;
+	}
+	return false;
+}
+
+size_t Journal::replay(SessionState& state, const Uint8* buffer, size_t size) {
+	size_t used = 0;
+	while (size - used >= sizeof(RecordHeader)) {
+		RecordHeader header;
+		memcpy(&header, buffer + used, sizeof(header));
+		if (size - used - sizeof(header) < header.length) {
+			break;
+		}
+		const Uint8* payload = buffer + used + sizeof(header);
+		if (header.crc != crc32(payload, header.length, crc32(&header, offsetof(RecordHeader, crc), 0)) ||
+			!apply(state, header.type, payload, header.length)) {
+			break;
+		}
+		used += sizeof(header) + header.length;
+	}
+	return used;
+}
+
+Sint64 Journal::wallClock() {
+	return (Sint64)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+Uint32 Journal::crc32(const void* data, size_t length, Uint32 crc) {
+	//Bitwise CRC-32, records are a few dozen bytes
+	const Uint8* bytes = (const Uint8*)data;
+	crc = ~crc;
+	for (size_t i = 0; i < length; ++i) {
+		crc ^= bytes[i];
+		for (int bit = 0; bit < 8; ++bit) {
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+bool Journal::writeSnapshot() {
+	Snapshot snapshot;
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.magic = 0x50414E53;
+	snapshot.state = mDurable;
+	snapshot.crc = crc32(&snapshot.state, sizeof(snapshot.state), 0);
+	//Write aside and rename over, a crash leaves either the old or the new snapshot
+	std::string tmpPath = mSnapshotPath + ".tmp";
+	int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Unable to write snapshot %s! Error: %s\n", tmpPath.c_str(), strerror(errno));
+		return false;
+	}
+	bool success = write(fd, &snapshot, sizeof(snapshot)) == (ssize_t)sizeof(snapshot) && fsync(fd) == 0;
+	::close(fd);
+	if (!success || rename(tmpPath.c_str(), mSnapshotPath.c_str()) != 0) {
+		printf("Unable to write snapshot %s! Error: %s\n", mSnapshotPath.c_str(), strerror(errno));
+		return false;
+	}
+	//The rename is only durable once the directory is, until then the journal is still needed
+	size_t slash = mSnapshotPath.rfind('/');
+	std::string dirPath = slash == std::string::npos ? "." : (slash == 0 ? "/" : mSnapshotPath.substr(0, slash));
+	int dirFd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY);
+	success = dirFd >= 0 && fsync(dirFd) == 0;
+	if (dirFd >= 0) {
+		::close(dirFd);
+	}
+	if (!success) {
+		printf("Unable to sync directory %s! Error: %s\n", dirPath.c_str(), strerror(errno));
+		return false;
+	}
+	//Snapshot holds everything on disk, start the journal over
+	if (ftruncate(mFd, 0) != 0 || fsync(mFd) != 0 || lseek(mFd, 0, SEEK_SET) != 0) {
+		printf("Unable to reset journal %s! Error: %s\n", mPath.c_str(), strerror(errno));
+		lseek(mFd, (off_t)mDurableOffset, SEEK_SET);
+		return false;
+	}
+	mDurableOffset = 0;
+	return true;
+}
+
+void Journal::writerLoop() {
+	std::vector<Uint8> batch;
+	Uint32 lastSnapshot = SDL_GetTicks();
+	std::unique_lock<std::mutex> lock(mMutex);
+	while (true) {
+		//Sleep until there is something to write, then let the batch fill up
+		while (!mStop && mPending.empty() && batch.empty()) {
+			mWake.wait(lock);
+		}
+		if (!mStop) {
+			mWake.wait_for(lock, std::chrono::milliseconds((Uint32)FLUSH_INTERVAL));
+		}
+		//Behind a failed batch, so the order on disk stays the same
+		batch.insert(batch.end(), mPending.begin(), mPending.end());
+		mPending.clear();
+		bool stop = mStop;
+		lock.unlock();
+		bool durable = true;
+		if (!batch.empty()) {
+			//One write and one fsync for the whole batch
+			size_t written = 0;
+			while (written < batch.size()) {
+				ssize_t n = write(mFd, &batch[written], batch.size() - written);
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+				if (n <= 0) {
+					printf("Journal write failed! Error: %s\n", strerror(errno));
+					break;
+				}
+				written += (size_t)n;
+			}
+			durable = written == batch.size();
+			if (durable && fsync(mFd) != 0) {
+				printf("Journal fsync failed! Error: %s\n", strerror(errno));
+				durable = false;
+			}
+			if (durable) {
+				replay(mDurable, &batch[0], batch.size());
+				mDurableOffset += batch.size();
+				batch.clear();
+			}
+			else {
+				//Roll back to the last whole record and retry with the next batch
+				if (ftruncate(mFd, (off_t)mDurableOffset) != 0) {
+					printf("Unable to roll back journal! Error: %s\n", strerror(errno));
+				}
+				lseek(mFd, (off_t)mDurableOffset, SEEK_SET);
+				if (batch.size() > MAX_RETRY) {
+					printf("Journal dropping %d unwritten bytes\n", (int)batch.size());
+					batch.clear();
+				}
+			}
+		}
+		if (durable && mDurableOffset > 0 && (stop || SDL_GetTicks() - lastSnapshot >= SNAPSHOT_INTERVAL)) {
+			writeSnapshot();
+			lastSnapshot = SDL_GetTicks();
+		}
+		if (stop) {
+			break;
+		}
+		lock.lock();
+	}
+}
+
+Telemetry::Telemetry() {
+	mListenFd = -1;
+	mEpollFd = -1;
+	mWakeFd = -1;
+	mPeriod = 100;
+	mLastPublish = 0;
+	mLastFrame = 0;
+	mFrames = 0;
+	mWorstFrame = 0;
+	mStop = false;
+	memset(&mPrevious, 0, sizeof(mPrevious));
+	mHasPrevious = false;
+	mSubscriberCount = 0;
+}
+
+Telemetry::~Telemetry() {
+	stop();
+}
+
+bool Telemetry::start(std::string address, int rateHz) {
+	if (rateHz < MIN_RATE || rateHz > MAX_RATE) {
+		printf("Telemetry rate %d is outside %d..%d Hz!\n", rateHz, MIN_RATE, MAX_RATE);
+		return false;
+	}
+	mPeriod = 1000 / rateHz;
+	if (!listenOn(address)) {
+		stop();
+		return false;
+	}
+	mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mEpollFd < 0 || mWakeFd < 0) {
+		printf("Unable to set up telemetry polling! Error: %s\n", strerror(errno));
+		stop();
+		return false;
+	}
+	epoll_event event;
+	event.events = EPOLLIN;
+	event.data.fd = mListenFd;
+	epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mListenFd, &event);
+	event.data.fd = mWakeFd;
+	epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &event);
+	mStop = false;
+	mIo = std::thread(&Telemetry::ioLoop, this);
+	return true;
+}
+
+bool Telemetry::listenOn(std::string address) {
+	if (!address.empty() && address[0] == '/') {
+		//Unix socket path
+		sockaddr_un local;
+		memset(&local, 0, sizeof(local));
+		local.sun_family = AF_UNIX;
+		if (address.size() >= sizeof(local.sun_path)) {
+			printf("Telemetry socket path %s is too long!\n", address.c_str());
+			return false;
+		}
+		strcpy(local.sun_path, address.c_str());
+		//Only replace a stale socket, never some other file
+		struct stat info;
+		if (lstat(address.c_str(), &info) == 0) {
+			if (!S_ISSOCK(info.st_mode)) {
+				printf("Telemetry path %s exists and is not a socket!\n", address.c_str());
+				return false;
+			}
+			unlink(address.c_str());
+		}
+		mListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (mListenFd < 0 || bind(mListenFd, (sockaddr*)&local, sizeof(local)) != 0 || listen(mListenFd, 8) != 0) {
+			printf("Unable to listen on %s! Error: %s\n", address.c_str(), strerror(errno));
+			return false;
+		}
+		mUnixPath = address;
+		return true;
+	}
+	//host:port, IPv4
+	size_t colon = address.rfind(':');
+	sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	if (colon == std::string::npos || inet_pton(AF_INET, address.substr(0, colon).c_str(), &local.sin_addr) != 1) {
+		printf("Telemetry address %s is not host:port or a socket path!\n", address.c_str());
+		return false;
+	}
+	char* end = NULL;
+	long port = strtol(address.c_str() + colon + 1, &end, 10);
+	if (end == address.c_str() + colon + 1 || *end != '\0' || port < 1 || port > 65535) {
+		printf("Telemetry port in %s must be 1..65535!\n", address.c_str());
+		return false;
+	}
+	local.sin_port = htons((Uint16)port);
+	mListenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int reuse = 1;
+	if (mListenFd < 0 || setsockopt(mListenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+		bind(mListenFd, (sockaddr*)&local, sizeof(local)) != 0 || listen(mListenFd, 8) != 0) {
+		printf("Unable to listen on %s! Error: %s\n", address.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void Telemetry::frameRendered() {
+	Uint32 now = SDL_GetTicks();
+	if (mLastFrame != 0 && now - mLastFrame > mWorstFrame) {
+		mWorstFrame = now - mLastFrame;
+	}
+	mLastFrame = now;
+	++mFrames;
+}
+
+void Telemetry::publish(Sint32 posX, Sint32 posY, double heading, Uint32 elapsed) {
+	Uint32 now = SDL_GetTicks();
+	if (mWakeFd < 0 || now - mLastPublish < mPeriod) {
+		return;
+	}
+	TelemetrySample sample;
+	sample.posX = posX;
+	sample.posY = posY;
+	sample.heading = (Sint16)floor(heading * 10 + 0.5);
+	sample.fps = (Uint16)(now - mLastPublish > 0 ? mFrames * 1000 / (now - mLastPublish) : 0);
+	sample.worstFrame = (Uint16)(mWorstFrame < 0xFFFF ? mWorstFrame : 0xFFFF);
+	sample.elapsed = elapsed;
+	mLastPublish = now;
+	mFrames = 0;
+	mWorstFrame = 0;
+	if (mSubscriberCount == 0) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		if (mQueue.size() >= SAMPLE_QUEUE) {
+			mQueue.pop_front();
+		}
+		mQueue.push_back(sample);
+	}
+	//No wakeup syscall here, the I/O thread polls the queue every period
+}
+
+Uint32 Telemetry::untilNextSample() {
+	if (mWakeFd < 0 || mSubscriberCount == 0) {
+		return (Uint32)-1;
+	}
+	Uint32 since = SDL_GetTicks() - mLastPublish;
+	return since >= mPeriod ? 0 : mPeriod - since;
+}
+
+void Telemetry::stop() {
+	if (mIo.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mStop = true;
+		}
+		Uint64 one = 1;
+		if (write(mWakeFd, &one, sizeof(one)) < 0) {
+			//Already signalled
+		}
+		mIo.join();
+	}
+	for (int i = (int)mSubscribers.size() - 1; i >= 0; --i) {
+		dropSubscriber(i);
+	}
+	if (mListenFd >= 0) {
+		::close(mListenFd);
+		mListenFd = -1;
+	}
+	if (!mUnixPath.empty()) {
+		unlink(mUnixPath.c_str());
+		mUnixPath.clear();
+	}
+	if (mWakeFd >= 0) {
+		::close(mWakeFd);
+		mWakeFd = -1;
+	}
+	if (mEpollFd >= 0) {
+		::close(mEpollFd);
+		mEpollFd = -1;
+	}
+}
+
+void Telemetry::ioLoop() {
+	epoll_event events[MAX_SUBSCRIBERS + 2];
+	std::vector<TelemetrySample> samples;
+	std::vector<Uint8> keyframe, delta;
+	while (true) {
+		//Without subscribers only a connection or stop can wake the thread
+		int count = epoll_wait(mEpollFd, events, MAX_SUBSCRIBERS + 2, mSubscribers.empty() ? -1 : (int)mPeriod);
+		if (count < 0 && errno != EINTR) {
+			printf("Telemetry polling failed! Error: %s\n", strerror(errno));
+			break;
+		}
+		for (int i = 0; i < count; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == mListenFd) {
+				acceptSubscribers();
+			}
+			else if (fd == mWakeFd) {
+				Uint64 value;
+				if (read(mWakeFd, &value, sizeof(value)) < 0) {
+					//Spurious wakeup
+				}
+			}
+			else {
+				for (int j = 0; j < (int)mSubscribers.size(); ++j) {
+					if (mSubscribers[j].fd != fd) {
+						continue;
+					}
+					//Subscribers send nothing, readable means closed or noise
+					bool alive = !(events[i].events & (EPOLLERR | EPOLLHUP));
+					if (alive && (events[i].events & EPOLLIN)) {
+						char discard[256];
+						ssize_t n = recv(fd, discard, sizeof(discard), 0);
+						alive = n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR));
+					}
+					if (alive && (events[i].events & EPOLLOUT)) {
+						alive = flush(mSubscribers[j]);
+					}
+					if (!alive) {
+						dropSubscriber(j);
+					}
+					break;
+				}
+			}
+		}
+		bool stop;
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			samples.assign(mQueue.begin(), mQueue.end());
+			mQueue.clear();
+			stop = mStop;
+		}
+		if (stop) {
+			break;
+		}
+		for (size_t i = 0; i < samples.size(); ++i) {
+			keyframe.clear();
+			delta.clear();
+			encodeKeyframe(samples[i], keyframe);
+			if (mHasPrevious) {
+				encodeDelta(mPrevious, samples[i], delta);
+			}
+			mPrevious = samples[i];
+			mHasPrevious = true;
+			for (int j = 0; j < (int)mSubscribers.size(); ++j) {
+				send(mSubscribers[j], keyframe, delta);
+			}
+		}
+		for (int j = (int)mSubscribers.size() - 1; j >= 0; --j) {
+			if (!samples.empty() && !flush(mSubscribers[j])) {
+				dropSubscriber(j);
+			}
+		}
+	}
+}
+
+void Telemetry::acceptSubscribers() {
+	while (true) {
+		int fd = accept4(mListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		if ((int)mSubscribers.size() >= MAX_SUBSCRIBERS) {
+			printf("Telemetry subscriber limit reached, refusing connection\n");
+			::close(fd);
+			continue;
+		}
+		int buffer = SOCKET_BUFFER;
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+		epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event);
+		Subscriber subscriber;
+		subscriber.fd = fd;
+		subscriber.sent = 0;
+		subscriber.needKeyframe = true;
+		subscriber.waitingWrite = false;
+		mSubscribers.push_back(subscriber);
+		mSubscriberCount = (int)mSubscribers.size();
+		//The idle loop sleeps without a sample deadline while nobody listens
+		if (gWakeEvent != (Uint32)-1) {
+			SDL_Event wake;
+			memset(&wake, 0, sizeof(wake));
+			wake.type = gWakeEvent;
+			SDL_PushEvent(&wake);
+		}
+	}
+}
+
+void Telemetry::send(Subscriber& subscriber, const std::vector<Uint8>& keyframe, const std::vector<Uint8>& delta) {
+	const std::vector<Uint8>& message = subscriber.needKeyframe || delta.empty() ? keyframe : delta;
+	if (subscriber.sent > 0) {
+		subscriber.out.erase(subscriber.out.begin(), subscriber.out.begin() + subscriber.sent);
+		subscriber.sent = 0;
+	}
+	//Slow subscriber, drop and resync with a keyframe once it catches up
+	if (subscriber.out.size() + message.size() > SUBSCRIBER_BUFFER) {
+		subscriber.needKeyframe = true;
+		return;
+	}
+	subscriber.out.insert(subscriber.out.end(), message.begin(), message.end());
+	subscriber.needKeyframe = false;
+}
+
+bool Telemetry::flush(Subscriber& subscriber) {
+	while (subscriber.sent < subscriber.out.size()) {
+		ssize_t n = ::send(subscriber.fd, &subscriber.out[subscriber.sent], subscriber.out.size() - subscriber.sent, MSG_NOSIGNAL);
+		if (n > 0) {
+			subscriber.sent += (size_t)n;
+		}
+		else if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			//Socket full, wait for EPOLLOUT
+			if (!subscriber.waitingWrite) {
+				epoll_event event;
+				event.events = EPOLLIN | EPOLLOUT;
+				event.data.fd = subscriber.fd;
+				epoll_ctl(mEpollFd, EPOLL_CTL_MOD, subscriber.fd, &event);
+				subscriber.waitingWrite = true;
+			}
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+	subscriber.out.clear();
+	subscriber.sent = 0;
+	if (subscriber.waitingWrite) {
+		epoll_event event;
+		event.events = EPOLLIN;
+		event.data.fd = subscriber.fd;
+		epoll_ctl(mEpollFd, EPOLL_CTL_MOD, subscriber.fd, &event);
+		subscriber.waitingWrite = false;
+	}
+	return true;
+}
+
+void Telemetry::dropSubscriber(int index) {
+	::close(mSubscribers[index].fd);
+	mSubscribers.erase(mSubscribers.begin() + index);
+	mSubscriberCount = (int)mSubscribers.size();
+}
+
+//Little endian fixed width field
+static void putBytes(std::vector<Uint8>& out, Uint32 value, int bytes) {
+	for (int i = 0; i < bytes; ++i) {
+		out.push_back((Uint8)(value >> (8 * i)));
+	}
+}
+
+//Zigzag then base 128, small changes of either sign take one byte
+static void putVarint(std::vector<Uint8>& out, Sint64 value) {
+	Uint64 zigzag = ((Uint64)value << 1) ^ (Uint64)(value >> 63);
+	while (zigzag >= 0x80) {
+		out.push_back((Uint8)(zigzag | 0x80));
+		zigzag >>= 7;
+	}
+	out.push_back((Uint8)zigzag);
+}
+
+void Telemetry::encodeKeyframe(const TelemetrySample& sample, std::vector<Uint8>& out) {
+	out.push_back(0x80);
+	putBytes(out, (Uint32)sample.posX, 4);
+	putBytes(out, (Uint32)sample.posY, 4);
+	putBytes(out, (Uint16)sample.heading, 2);
+	putBytes(out, sample.fps, 2);
+	putBytes(out, sample.worstFrame, 2);
+	putBytes(out, sample.elapsed, 4);
+}
+
+void Telemetry::encodeDelta(const TelemetrySample& previous, const TelemetrySample& sample, std::vector<Uint8>& out) {
+	Sint64 changes[6] = {
+		(Sint64)sample.posX - previous.posX,
+		(Sint64)sample.posY - previous.posY,
+		(Sint64)sample.heading - previous.heading,
+		(Sint64)sample.fps - previous.fps,
+		(Sint64)sample.worstFrame - previous.worstFrame,
+		(Sint64)sample.elapsed - previous.elapsed
+	};
+	Uint8 mask = 0;
+	for (int i = 0; i < 6; ++i) {
+		if (changes[i] != 0) {
+			mask |= (Uint8)(1 << i);
+		}
+	}
+	out.push_back(mask);
+	for (int i = 0; i < 6; ++i) {
+		if (changes[i] != 0) {
+			putVarint(out, changes[i]);
+		}
+	}
+}
+
+IdleScheduler::IdleScheduler() {
+	mActive = true;
+	mLastTick = SDL_GetTicks();
+	mLastCpu = clock();
+	mLastReport = mLastTick;
+	for (int i = 0; i < 2; ++i) {
+		mWall[i] = 0;
+		mCpu[i] = 0;
+		mFrames[i] = 0;
+	}
+}
+
+bool IdleScheduler::wait(bool active, Uint32 timeout) {
+	account();
+	mActive = active;
+	if (SDL_GetTicks() - mLastReport >= REPORT_INTERVAL) {
+		report();
+		mLastReport = SDL_GetTicks();
+	}
+	if (active) {
+		return true;
+	}
+	//The next report is a deadline too
+	Uint32 untilReport = REPORT_INTERVAL - (SDL_GetTicks() - mLastReport);
+	if (untilReport > REPORT_INTERVAL) {
+		untilReport = 0;
+	}
+	if (timeout > untilReport) {
+		timeout = untilReport;
+	}
+	//NULL leaves the event queued for the normal poll loop
+	return SDL_WaitEventTimeout(NULL, (int)timeout) == 1;
+}
+
+void IdleScheduler::frameRendered() {
+	++mFrames[mActive ? 1 : 0];
+}
+
+void IdleScheduler::report() {
+	account();
+	const char* names[2] = { "Idle", "Active" };
+	for (int i = 0; i < 2; ++i) {
+		if (mWall[i] == 0) {
+			continue;
+		}
+		//clock() covers every thread, GPU load follows presented frames
+		printf("%s: %.1f s, CPU %.1f%%, %.1f frames/s\n", names[i], mWall[i] / 1000.0,
+			mCpu[i] * 100000.0 / mWall[i], mFrames[i] * 1000.0 / mWall[i]);
+	}
+}
+
+void IdleScheduler::account() {
+	Uint32 now = SDL_GetTicks();
+	clock_t cpu = clock();
+	int mode = mActive ? 1 : 0;
+	mWall[mode] += now - mLastTick;
+	mCpu[mode] += (double)(cpu - mLastCpu) / CLOCKS_PER_SEC;
+	mLastTick = now;
+	mLastCpu = cpu;
+}
 
 bool init() {
 	//init flag
@@ -373,6 +1864,8 @@ bool init() {
 					}
 					//Init renderer color
 					SDL_SetRenderDrawColor(gRendererMain, 0xFF, 0xFF, 0xFF, 0xFF);
+					//Wake up event for background threads
+					gWakeEvent = SDL_RegisterEvents(1);
 				
 			}
 		}
@@ -550,6 +2043,12 @@ SDL_Surface* loadSurface(std::string path) {
 }
 
 int main(int argc, char* args[]) {
+	//Guidance replanning check, needs no window
+	if (argc > 1 && strcmp(args[1], "--check-guidance") == 0) {
+		bool passed = Guidance::selfTest();
+		printf("Guidance check %s\n", passed ? "passed" : "failed");
+		return passed ? 0 : 1;
+	}
 	//Start up SDL and create window
 	if (!init()) {
 		printf("Failed to initialize!\n");
@@ -577,17 +2076,75 @@ int main(int argc, char* args[]) {
 			wall.w = 389;
 			wall.h = 560;
 			SDL_Rect camera = { wall.x, wall.y, wall.w, wall.h};
+			//Guidance, default A-B line runs north through the start position
+			Guidance guidance;
+			FieldPoint abPointA = { (double)dot.getPosX() + Dot::DOT_WIDTH / 2, (double)dot.getPosY() + Dot::DOT_HEIGHT / 2 };
+			FieldPoint abPointB = { abPointA.x, 0 };
+			guidance.addObstacle(wall);
+			guidance.setABLine(abPointA, abPointB);
 			//Current rendered texture
 			LTexture* currentTexture = NULL;
 			int frame = 0;
 			double degrees = 0;
 			SDL_RendererFlip flipType = SDL_FLIP_NONE;
 			gKeys = gKeyPressSurfaces[KEY_PRESS_SURFACE_DEFAULT];
+			//Pick up where the last session stopped or crashed
+			Journal journal;
+			SessionState session;
+			memset(&session, 0, sizeof(session));
+			bool recovered = false;
+			if (!journal.open("session.journal", session, recovered)) {
+				printf("Failed to open session journal, running without persistence!\n");
+			}
+			else if (recovered) {
+				dot.mPosX = session.posX;
+				dot.mPosY = session.posY;
+				degrees = session.degrees;
+				if (session.hasABLine) {
+					abPointA = session.abA;
+					abPointB = session.abB;
+					guidance.setABLine(abPointA, abPointB);
+				}
+				guidance.update(dot.getPosX() + Dot::DOT_WIDTH / 2.0, dot.getPosY() + Dot::DOT_HEIGHT / 2.0);
+			}
+			//The session timer counts from the stored start, so it runs on while the app is closed
+			Sint64 wallNow = Journal::wallClock();
+			if (session.sessionStart != 0 && session.sessionStart <= wallNow) {
+				startTime = SDL_GetTicks() - (Uint32)(wallNow - session.sessionStart);
+			}
+			else {
+				startTime = SDL_GetTicks();
+				journal.logSessionStart(wallNow);
+			}
+			//Telemetry for the farm office, off unless --telemetry <host:port|/socket/path> is given
+			std::string telemetryAddress;
+			int telemetryRate = 10;
+			for (int i = 1; i + 1 < argc; ++i) {
+				if (strcmp(args[i], "--telemetry") == 0) {
+					telemetryAddress = args[++i];
+				}
+				else if (strcmp(args[i], "--telemetry-rate") == 0) {
+					telemetryRate = atoi(args[++i]);
+				}
+			}
+			Telemetry telemetry;
+			if (!telemetryAddress.empty() && !telemetry.start(telemetryAddress, telemetryRate)) {
+				printf("Failed to start telemetry, running without it!\n");
+			}
+			//Direction of travel, kept while the dot stands still
+			double heading = 0;
 
+			//Sleeps instead of spinning while parked
+			IdleScheduler idle;
 			//while app still running
 			while (!quit) {
+				//Active while moving, animating the seeder or holding a key
+				const Uint8* keyStates = SDL_GetKeyboardState(NULL);
+				bool active = dot.mVelX != 0 || dot.mVelY != 0 || keyStates[SDL_SCANCODE_UP] || keyStates[SDL_SCANCODE_DOWN];
+				bool redraw = idle.wait(active, telemetry.untilNextSample());
 				//handle events on queue
 				while (SDL_PollEvent(&e) != 0) {
+					redraw = true;
 					
 					if (e.type == SDL_QUIT) {
 
@@ -596,6 +2153,18 @@ int main(int argc, char* args[]) {
 					}
 					else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_RETURN) {
 						startTime = SDL_GetTicks();
+						journal.logSessionStart(Journal::wallClock());
+					}
+					//A marks the start of a new A-B line, B finishes it and replans
+					else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_a) {
+						abPointA.x = dot.getPosX() + Dot::DOT_WIDTH / 2;
+						abPointA.y = dot.getPosY() + Dot::DOT_HEIGHT / 2;
+					}
+					else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_b) {
+						abPointB.x = dot.getPosX() + Dot::DOT_WIDTH / 2;
+						abPointB.y = dot.getPosY() + Dot::DOT_HEIGHT / 2;
+						guidance.setABLine(abPointA, abPointB);
+						journal.logABLine(abPointA, abPointB);
 					}
 					//Clear screen
 					SDL_RenderClear(gRendererMain);
@@ -636,6 +2205,12 @@ int main(int argc, char* args[]) {
 					SDL_SetRenderDrawColor(gRendererMain, 0x00, 0x00, 0xFF, 0xFF);
 					SDL_RenderDrawLine(gRendererMain, 0, 199, 524, 199);
 					SDL_RenderDrawLine(gRendererMain, 265.5, 0, 265.5, 392);
+					//Draw green guidance line, offset from the vehicle by the cross-track error
+					int guideX = 265 - (int)guidance.getCrossTrackError();
+					if (guideX >= 0 && guideX < LeftViewer.w) {
+						SDL_SetRenderDrawColor(gRendererMain, 0x00, 0xC0, 0x00, 0xFF);
+						SDL_RenderDrawLine(gRendererMain, guideX, 0, guideX, 392);
+					}
 
 					//////////////////////////////SEED RIGHT VIEW///////////////////////////////////
 					SDL_Rect RightViewer;
@@ -684,6 +2259,7 @@ int main(int argc, char* args[]) {
 						SDL_RenderSetViewport(gRendererMain, &wall);
 						gMapRight.render(wall.x, wall.y, &camera);
 						dot.render(camera.x, camera.y, !quit);//The one thats need to be up top
+						guidance.render(camera.x, camera.y);
 						SDL_RenderSetViewport(gRendererMain, &BackViewer);
 					}
 					
@@ -701,6 +2277,8 @@ int main(int argc, char* args[]) {
 					//////////////////////////////////Dot//////////////////////////////////////////////
 					dot.handleEvent(e);
 					dot.move(wall);
+					//Cross-track error from the dot centre
+					guidance.update(dot.getPosX() + Dot::DOT_WIDTH / 2.0, dot.getPosY() + Dot::DOT_HEIGHT / 2.0);
 					//Center camera over the dot
 					camera.x = (dot.getPosX() + Dot::DOT_WIDTH / 2) - RightViewer.x;
 					camera.y = (dot.getPosY() + Dot::DOT_HEIGHT / 2) - RightViewer.y;
@@ -722,16 +2300,31 @@ int main(int argc, char* args[]) {
 
 					
 				}
-				//render wall
-				SDL_RenderDrawRect(gRendererMain, &wall);
-				//render dot
+				//Nothing arrived and nothing moved, skip rendering
+				if (redraw) {
+					//render wall
+					SDL_RenderDrawRect(gRendererMain, &wall);
+					//render dot
 					//DOT
-				
+
 					SDL_RenderPresent(gRendererMain);
 					//Update the surface
 					//SDL_UpdateWindowSurface(gWindow);
+					telemetry.frameRendered();
+					idle.frameRendered();
 				}
+				//Queue vehicle state for the journal
+				journal.logState(dot.mPosX, dot.mPosY, degrees);
+				//Stream status
+				if (dot.mVelX != 0 || dot.mVelY != 0) {
+					heading = atan2((double)dot.mVelX, (double)-dot.mVelY) * 180.0 / 3.14159265358979;
+				}
+				telemetry.publish(dot.mPosX, dot.mPosY, heading, SDL_GetTicks() - startTime);
 			}
+			idle.report();
+			telemetry.stop();
+			journal.close();
+		}
 			close();
 			return 0;
 		}
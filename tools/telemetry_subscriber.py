@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+# Telemetry subscriber for StuurmanNav, decodes the keyframe/delta stream
+# described in README.md and checks it stays consistent.
+#
+#   python3 tools/telemetry_subscriber.py 127.0.0.1:7400 --duration 10
+#   python3 tools/telemetry_subscriber.py /tmp/stuurman.sock --stall 30 --duration 40
+#
+# --stall stops reading after the first message so the publisher has to drop
+# samples; after the stall the stream must resync with a new keyframe.
+# Exit code is 0 when the stream decoded cleanly (and resynced, with --stall).
+import argparse
+import socket
+import struct
+import sys
+import time
+
+FIELDS = ("posX", "posY", "heading", "fps", "worstFrame", "elapsed")
+KEYFRAME = struct.Struct("<iihHHI")
+
+
+def connect(address, small_buffer):
+    if address.startswith("/"):
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    else:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    if small_buffer:
+        # Tiny receive window so a stall reaches the publisher quickly
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1024)
+    if address.startswith("/"):
+        sock.connect(address)
+    else:
+        host, port = address.rsplit(":", 1)
+        sock.connect((host, int(port)))
+    return sock
+
+
+def read_varint(buffer, i):
+    value = 0
+    shift = 0
+    while True:
+        if i >= len(buffer):
+            return None, i
+        byte = buffer[i]
+        i += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if byte < 0x80:
+            # Undo zigzag
+            return (value >> 1) ^ -(value & 1), i
+
+
+def decode(buffer, state):
+    """Decodes whole messages from buffer, returns (messages, bytes used)."""
+    messages = []
+    i = 0
+    while i < len(buffer):
+        mask = buffer[i]
+        if mask & 0x80:
+            if len(buffer) - i - 1 < KEYFRAME.size:
+                break
+            state[:] = list(KEYFRAME.unpack_from(buffer, i + 1))
+            messages.append(("keyframe", list(state)))
+            i += 1 + KEYFRAME.size
+            continue
+        if not state:
+            raise ValueError("delta before any keyframe")
+        j = i + 1
+        changes = []
+        for field in range(len(FIELDS)):
+            if mask & (1 << field):
+                value, j = read_varint(buffer, j)
+                if value is None:
+                    break
+                changes.append((field, value))
+        else:
+            for field, value in changes:
+                state[field] += value
+            messages.append(("delta", list(state)))
+            i = j
+            continue
+        break
+    return messages, i
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("address", help="host:port or Unix socket path")
+    parser.add_argument("--duration", type=float, default=10, help="seconds to listen")
+    parser.add_argument("--stall", type=float, default=0, help="seconds to stop reading after the first message")
+    parser.add_argument("--verbose", action="store_true", help="print every decoded sample")
+    args = parser.parse_args()
+
+    sock = connect(args.address, args.stall > 0)
+    sock.settimeout(0.5)
+    deadline = time.time() + args.duration
+    buffer = b""
+    state = []
+    counts = {"keyframe": 0, "delta": 0}
+    resyncs = 0
+    stalled = False
+    try:
+        while time.time() < deadline:
+            try:
+                data = sock.recv(4096)
+            except socket.timeout:
+                continue
+            if not data:
+                print("publisher closed the connection")
+                break
+            buffer += data
+            messages, used = decode(buffer, state)
+            buffer = buffer[used:]
+            for kind, sample in messages:
+                counts[kind] += 1
+                if kind == "keyframe" and counts["keyframe"] > 1:
+                    resyncs += 1
+                if args.verbose:
+                    print(kind, dict(zip(FIELDS, sample)))
+            if args.stall > 0 and not stalled and messages:
+                stalled = True
+                print("stalling for %.0f s" % args.stall)
+                time.sleep(args.stall)
+    except ValueError as error:
+        print("decode error:", error)
+        return 1
+    print("keyframes %d, deltas %d, resyncs %d" % (counts["keyframe"], counts["delta"], resyncs))
+    if state:
+        print("last", dict(zip(FIELDS, state)))
+    if counts["keyframe"] == 0:
+        return 1
+    if args.stall > 0 and resyncs == 0:
+        print("no resync after the stall, stall longer or raise --telemetry-rate")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())